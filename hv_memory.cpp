@@ -3,6 +3,9 @@
 #include <iostream>
 #include <iomanip>
 #include "hdc_controller.h" 
+#include <thread>
+#include <bitset>
+#include <algorithm>
 
 // Initialize HV memory for discrete items (IM)
 void HV_Memory::init_hv_memory() {
@@ -286,6 +289,462 @@ void HV_Memory::map_emg_to_hv(const std::string& emg_file, const std::string& la
 }
 
 
+// Number of worker threads used for a loop over "count" items
+static int worker_count(int count) {
+    int workers = static_cast<int>(std::thread::hardware_concurrency());
+    if (workers < 1) workers = 1;
+    if (workers > count) workers = count;
+    return workers;
+}
+
+// Split [0, count) into one contiguous chunk per worker and run body(begin, end, worker) on each chunk in its own thread
+template <typename Body>
+static void run_parallel(int count, int workers, Body body) {
+    std::vector<std::thread> threads;
+    int chunk = (count + workers - 1) / workers;
+    for (int w = 0; w < workers; w++) {
+        int begin = w * chunk;
+        int end = (begin + chunk < count) ? begin + chunk : count;
+        threads.push_back(std::thread(body, begin, end, w));
+    }
+    for (size_t t = 0; t < threads.size(); t++) {
+        threads[t].join();
+    }
+}
+
+// Add (sign = 1) or subtract (sign = -1) a packed bipolar hypervector to a class accumulator
+static void accumulate_packed(float* accumulator, const hv_packed& hv, int sign) {
+    for (int i = 0; i < DIMENSION; i++) {
+        accumulator[i] += ((hv[i / 32] >> (i % 32)) & 1u) ? sign : -sign;
+    }
+}
+
+// Pack a bipolar hypervector, one bit per component. Unused bits of the last word stay cleared
+void HV_Memory::pack_hv(hv_bp& hv, hv_packed& packed) {
+    memset(packed, 0, sizeof(hv_packed));
+    for (int i = 0; i < DIMENSION; i++) {
+        if (hv[i] == ONE_BP) {
+            packed[i / 32] |= (1u << (i % 32));
+        }
+    }
+}
+
+// Same result as hamming_distance(), but compares 32 components at once
+int HV_Memory::hamming_distance_packed(const hv_packed& hv1, const hv_packed& hv2) {
+    int distance = 0;
+    for (int w = 0; w < HV_WORDS; w++) {
+        distance += static_cast<int>(std::bitset<32>(hv1[w] ^ hv2[w]).count()); // differing components are the set bits of the xor
+    }
+    return distance;
+}
+
+// Associative search: the predicted class is the AM entry with the smallest hamming distance (lowest id wins a tie)
+int HV_Memory::classify_packed(const hv_packed& query, hv_packed* am_packed) {
+    int best_class = 0;
+    int best_distance = DIMENSION + 1;
+    for (int c = 0; c < entries; c++) {
+        int distance = hamming_distance_packed(query, am_packed[c]);
+        if (distance < best_distance) {
+            best_distance = distance;
+            best_class = c;
+        }
+    }
+    return best_class;
+}
+
+/* Encode one EMG sample: every channel hv from the IM is bound with the level hv from the CiM,
+ the bound vectors are bundled over all channels and the thresholded result is packed */
+void HV_Memory::encode_sample(HV_Memory& item_memory, HV_Memory& continuous_memory, const std::vector<float>& emg_values, hv_packed& packed) {
+    int bundled_result[DIMENSION] = { 0 };
+    hv_bp result;
+
+    for (int channel = 0; channel < static_cast<int>(emg_values.size()); channel++) {
+        hv_bp channel_hv, level_hv;
+
+        // Quantize the EMG value to one of the CiM levels, values outside [MIN_LEVEL, MAX_LEVEL] are clamped
+        int level = static_cast<int>((emg_values[channel] - MIN_LEVEL) / (MAX_LEVEL - MIN_LEVEL) * (continuous_memory.entries - 1));
+        if (level < 0) level = 0;
+        if (level > continuous_memory.entries - 1) level = continuous_memory.entries - 1;
+
+        item_memory.read_bipolar_IM(channel % item_memory.entries, channel_hv);
+        continuous_memory.read_bipolar_CiM(level, level_hv);
+
+        // Binding and bundling in one step
+        for (int i = 0; i < DIMENSION; i++) {
+            bundled_result[i] += channel_hv[i] * level_hv[i];
+        }
+    }
+
+    for (int i = 0; i < DIMENSION; i++) {
+        result[i] = (bundled_result[i] > 0) ? ONE_BP : MINUSONE;
+    }
+    pack_hv(result, packed);
+}
+
+/* Parse and encode the whole training set once into encoded_cache (stored in the AM module).
+ Rows with a wrong number of EMG values or an invalid label are dropped. Returns the number of cached samples */
+int HV_Memory::encode_training_set(HV_Memory& item_memory, HV_Memory& continuous_memory, const std::string& emg_file, const std::string& label_file) {
+    std::ifstream emg_input(emg_file);
+    std::ifstream label_input(label_file);
+
+    if (!emg_input.is_open() || !label_input.is_open()) {
+        std::cerr << "Error: Could not open training files." << std::endl;
+        return 0;
+    }
+
+    free_encoded_cache();
+
+    /* Read labels, invalid rows are kept as -1 so that labels stay aligned with the EMG rows.
+    Only a first line that cannot be parsed as a number is treated as a header */
+    std::vector<int> labels;
+    std::string line;
+    bool is_first_line = true;
+    while (std::getline(label_input, line)) {
+        line.erase(0, line.find_first_not_of(" \t\n\r"));
+        line.erase(line.find_last_not_of(" \t\n\r") + 1);
+        if (line.empty()) {
+            continue;
+        }
+
+        try {
+            int label = std::stoi(line);
+            labels.push_back((label >= 0 && label < entries) ? label : -1);
+        }
+        catch (const std::exception& e) {
+            if (is_first_line) {
+                std::cout << "Skipping header line: " << line << std::endl;
+            }
+            else {
+                labels.push_back(-1);
+            }
+        }
+        is_first_line = false;
+    }
+
+    // Read EMG rows, blank lines are skipped the same way as in the label file
+    std::vector<std::vector<float>> emg_rows;
+    while (std::getline(emg_input, line)) {
+        line.erase(0, line.find_first_not_of(" \t\n\r"));
+        line.erase(line.find_last_not_of(" \t\n\r") + 1);
+        if (line.empty()) {
+            continue;
+        }
+
+        std::istringstream stream(line);
+        std::string value;
+        std::vector<float> emg_values;
+
+        try {
+            while (std::getline(stream, value, ',')) {
+                emg_values.push_back(std::stof(value));
+            }
+        }
+        catch (const std::exception& e) {
+            emg_values.clear();
+        }
+        emg_rows.push_back(emg_values);
+    }
+
+    if (emg_rows.size() != labels.size()) {
+        std::cerr << "Warning: EMG file has " << emg_rows.size() << " rows but label file has " << labels.size()
+            << " labels, only the first " << std::min(emg_rows.size(), labels.size()) << " rows are used." << std::endl;
+        emg_rows.resize(std::min(emg_rows.size(), labels.size()));
+    }
+
+    // Keep only the valid rows
+    std::vector<int> valid_rows;
+    for (int row = 0; row < static_cast<int>(emg_rows.size()); row++) {
+        if (labels[row] >= 0 && emg_rows[row].size() == NUM_CHANNELS) {
+            valid_rows.push_back(row);
+        }
+    }
+    if (valid_rows.size() < emg_rows.size()) {
+        std::cerr << "Warning: Dropped " << emg_rows.size() - valid_rows.size() << " invalid training rows." << std::endl;
+    }
+    if (valid_rows.empty()) {
+        return 0;
+    }
+
+    encoded_samples = static_cast<int>(valid_rows.size());
+    encoded_cache = (hv_packed*)malloc(encoded_samples * sizeof(hv_packed));
+    encoded_labels = (int*)malloc(encoded_samples * sizeof(int));
+    if (!encoded_cache || !encoded_labels) {
+        std::cerr << "Error: Could not allocate memory for " << encoded_samples << " encoded training samples." << std::endl;
+        free_encoded_cache();
+        return 0;
+    }
+
+    // Samples are independent of each other, so they are encoded in parallel directly into their cache slot
+    run_parallel(encoded_samples, worker_count(encoded_samples), [&](int begin, int end, int /*worker*/) {
+        for (int s = begin; s < end; s++) {
+            encode_sample(item_memory, continuous_memory, emg_rows[valid_rows[s]], encoded_cache[s]);
+            encoded_labels[s] = labels[valid_rows[s]];
+        }
+    });
+
+    std::cout << name() << " encoded " << encoded_samples << " training samples" << std::endl;
+    return encoded_samples;
+}
+
+// FNV-1a hash over the bytes of a file, used to detect changed training files
+static uint32_t file_checksum(const std::string& file_name) {
+    std::ifstream input(file_name, std::ios::binary);
+    uint32_t hash = 2166136261u;
+    char buffer[4096];
+    while (input.read(buffer, sizeof(buffer)) || input.gcount() > 0) {
+        for (std::streamsize i = 0; i < input.gcount(); i++) {
+            hash = (hash ^ static_cast<unsigned char>(buffer[i])) * 16777619u;
+        }
+    }
+    return hash;
+}
+
+/* On-disk layout of the cache: DIMENSION, NUM_CHANNELS, IM checksum, CiM checksum, EMG file checksum,
+ label file checksum, number of samples, followed by the labels and the packed hvs.
+ The checksums make sure a cache is only reused with the same IM, CiM and training files.
+ An empty cache_file disables the on-disk cache, the encoded training set is then only kept in memory */
+bool HV_Memory::save_encoded_cache(const std::string& cache_file, HV_Memory& item_memory, HV_Memory& continuous_memory, const std::string& emg_file, const std::string& label_file) {
+    if (!encoded_cache || cache_file.empty()) {
+        return false;
+    }
+
+    std::ofstream output(cache_file, std::ios::binary);
+    if (!output.is_open()) {
+        std::cerr << "Error: Could not open cache file " << cache_file << " for writing." << std::endl;
+        return false;
+    }
+
+    uint32_t header[7] = { DIMENSION, NUM_CHANNELS, item_memory.memory_checksum(), continuous_memory.memory_checksum(),
+        file_checksum(emg_file), file_checksum(label_file), static_cast<uint32_t>(encoded_samples) };
+    output.write(reinterpret_cast<const char*>(header), sizeof(header));
+    output.write(reinterpret_cast<const char*>(encoded_labels), encoded_samples * sizeof(int));
+    output.write(reinterpret_cast<const char*>(encoded_cache), encoded_samples * sizeof(hv_packed));
+    return output.good();
+}
+
+bool HV_Memory::load_encoded_cache(const std::string& cache_file, HV_Memory& item_memory, HV_Memory& continuous_memory, const std::string& emg_file, const std::string& label_file) {
+    if (cache_file.empty()) {
+        return false; // in-memory only
+    }
+
+    std::ifstream input(cache_file, std::ios::binary);
+    if (!input.is_open()) {
+        return false; // no cache yet
+    }
+
+    uint32_t header[7];
+    input.read(reinterpret_cast<char*>(header), sizeof(header));
+    if (!input || header[0] != DIMENSION || header[1] != NUM_CHANNELS
+        || header[2] != item_memory.memory_checksum() || header[3] != continuous_memory.memory_checksum()
+        || header[4] != file_checksum(emg_file) || header[5] != file_checksum(label_file) || header[6] == 0) {
+        std::cout << "Ignoring stale cache file " << cache_file << std::endl;
+        return false;
+    }
+
+    // The sample count must match the size of the file body, so a corrupt count can not cause a huge allocation
+    std::streamoff body_start = input.tellg();
+    input.seekg(0, std::ios::end);
+    uint64_t body_size = static_cast<uint64_t>(input.tellg() - body_start);
+    input.seekg(body_start);
+    if (body_size != static_cast<uint64_t>(header[6]) * (sizeof(int) + sizeof(hv_packed))) {
+        std::cerr << "Error: Cache file " << cache_file << " has the wrong size." << std::endl;
+        return false;
+    }
+
+    free_encoded_cache();
+    encoded_samples = static_cast<int>(header[6]);
+    encoded_cache = (hv_packed*)malloc(encoded_samples * sizeof(hv_packed));
+    encoded_labels = (int*)malloc(encoded_samples * sizeof(int));
+    if (!encoded_cache || !encoded_labels) {
+        std::cerr << "Error: Could not allocate memory for " << encoded_samples << " encoded training samples." << std::endl;
+        free_encoded_cache();
+        return false;
+    }
+    input.read(reinterpret_cast<char*>(encoded_labels), encoded_samples * sizeof(int));
+    input.read(reinterpret_cast<char*>(encoded_cache), encoded_samples * sizeof(hv_packed));
+
+    if (!input) {
+        std::cerr << "Error: Cache file " << cache_file << " is truncated." << std::endl;
+        free_encoded_cache();
+        return false;
+    }
+    for (int s = 0; s < encoded_samples; s++) {
+        if (encoded_labels[s] < 0 || encoded_labels[s] >= entries) {
+            std::cerr << "Error: Cache file " << cache_file << " contains an invalid label." << std::endl;
+            free_encoded_cache();
+            return false;
+        }
+    }
+
+    std::cout << name() << " loaded " << encoded_samples << " encoded training samples from " << cache_file << std::endl;
+    return true;
+}
+
+void HV_Memory::free_encoded_cache() {
+    if (encoded_cache) free(encoded_cache);
+    if (encoded_labels) free(encoded_labels);
+    encoded_cache = nullptr;
+    encoded_labels = nullptr;
+    encoded_samples = 0;
+}
+
+// FNV-1a hash over the bipolar memory
+uint32_t HV_Memory::memory_checksum() {
+    uint32_t hash = 2166136261u;
+    if (!memory_bipolar) {
+        return hash;
+    }
+    for (int i = 0; i < entries; i++) {
+        for (int j = 0; j < DIMENSION; j++) {
+            hash = (hash ^ static_cast<uint32_t>(memory_bipolar[i][j] > 0)) * 16777619u;
+        }
+    }
+    return hash;
+}
+
+/* Perceptron-style retraining over the encoded cache.
+ The AM is first built by bundling every sample into its class. Each epoch then applies the perceptron rule per sample,
+ in sample order: when a sample is misclassified it is added to the true class and subtracted from the predicted class,
+ and the thresholded AM is updated right away for the following samples.
+ To run an epoch in parallel the samples are split into RETRAIN_SHARDS interleaved shards (sample s belongs to shard
+ s % RETRAIN_SHARDS). Every shard starts from the same accumulators and runs the per-sample updates on its own copy,
+ after the epoch the shard accumulators are averaged (iterative parameter mixing). This deviates from a single
+ sequential perceptron pass, but the averaging damps the updates so the error count settles, and since the shards
+ do not depend on the number of threads the result is the same on every machine */
+void HV_Memory::retrain(int epochs) {
+    if (!encoded_cache || encoded_samples == 0) {
+        std::cerr << "Error: No encoded training set, call encode_training_set() or load_encoded_cache() first." << std::endl;
+        return;
+    }
+    if (epochs < 0) {
+        epochs = 0;
+    }
+
+    int shards = (encoded_samples < RETRAIN_SHARDS) ? encoded_samples : RETRAIN_SHARDS;
+    int workers = worker_count(shards);
+    std::vector<float> accumulator(entries * DIMENSION, 0.0f); // class accumulators, the AM is their thresholded version
+    std::vector<std::vector<float>> shard_accumulators(shards, std::vector<float>(entries * DIMENSION));
+    std::vector<int> errors(shards);
+    hv_packed* am_packed = (hv_packed*)malloc(entries * sizeof(hv_packed));
+    hv_packed* shard_am_packed = (hv_packed*)malloc(shards * entries * sizeof(hv_packed)); // packed AM of every shard
+    if (!am_packed || !shard_am_packed) {
+        std::cerr << "Error: Could not allocate memory for retraining." << std::endl;
+        if (am_packed) free(am_packed);
+        if (shard_am_packed) free(shard_am_packed);
+        return;
+    }
+
+    // Apply thresholding to one class of the accumulators and pack the result
+    auto threshold_class = [&](const std::vector<float>& source, int c, hv_packed& packed) {
+        hv_bp result;
+        for (int i = 0; i < DIMENSION; i++) {
+            result[i] = (source[c * DIMENSION + i] > 0) ? ONE_BP : MINUSONE;
+        }
+        pack_hv(result, packed);
+    };
+
+    // Initial single bundle pass
+    run_parallel(shards, workers, [&](int begin, int end, int /*worker*/) {
+        for (int shard = begin; shard < end; shard++) {
+            std::vector<float>& local = shard_accumulators[shard];
+            std::fill(local.begin(), local.end(), 0.0f);
+            for (int s = shard; s < encoded_samples; s += shards) {
+                accumulate_packed(&local[encoded_labels[s] * DIMENSION], encoded_cache[s], 1);
+            }
+        }
+    });
+    for (int shard = 0; shard < shards; shard++) {
+        for (int i = 0; i < entries * DIMENSION; i++) {
+            accumulator[i] += shard_accumulators[shard][i];
+        }
+    }
+    for (int c = 0; c < entries; c++) {
+        threshold_class(accumulator, c, am_packed[c]);
+    }
+
+    for (int epoch = 1; epoch <= epochs; epoch++) {
+        run_parallel(shards, workers, [&](int begin, int end, int /*worker*/) {
+            for (int shard = begin; shard < end; shard++) {
+                std::vector<float>& local = shard_accumulators[shard];
+                hv_packed* local_am = shard_am_packed + shard * entries;
+                local = accumulator;
+                memcpy(local_am, am_packed, entries * sizeof(hv_packed));
+                errors[shard] = 0;
+
+                for (int s = shard; s < encoded_samples; s += shards) {
+                    int label = encoded_labels[s];
+                    int predicted = classify_packed(encoded_cache[s], local_am);
+                    if (predicted != label) {
+                        accumulate_packed(&local[label * DIMENSION], encoded_cache[s], 1);
+                        accumulate_packed(&local[predicted * DIMENSION], encoded_cache[s], -1);
+                        threshold_class(local, label, local_am[label]);
+                        threshold_class(local, predicted, local_am[predicted]);
+                        errors[shard]++;
+                    }
+                }
+            }
+        });
+
+        // Average the shard accumulators, shards are summed in a fixed order
+        int total_errors = 0;
+        std::fill(accumulator.begin(), accumulator.end(), 0.0f);
+        for (int shard = 0; shard < shards; shard++) {
+            for (int i = 0; i < entries * DIMENSION; i++) {
+                accumulator[i] += shard_accumulators[shard][i];
+            }
+            total_errors += errors[shard];
+        }
+        for (int i = 0; i < entries * DIMENSION; i++) {
+            accumulator[i] /= shards;
+        }
+        for (int c = 0; c < entries; c++) {
+            threshold_class(accumulator, c, am_packed[c]);
+        }
+
+        std::cout << "Retraining epoch " << epoch << ": " << total_errors << " of " << encoded_samples << " samples misclassified" << std::endl;
+        if (total_errors == 0) {
+            break; // no shard made an update, so the AM classifies every training sample correctly
+        }
+    }
+
+    // Write the retrained classes to the AM
+    for (int c = 0; c < entries; c++) {
+        hv_bp result;
+        for (int i = 0; i < DIMENSION; i++) {
+            result[i] = (accumulator[c * DIMENSION + i] > 0) ? ONE_BP : MINUSONE;
+        }
+        write_bipolar_AM(c, result);
+    }
+
+    free(am_packed);
+    free(shard_am_packed);
+}
+
+// Put the AM in retraining mode, its training pass then trains on the training set encoded with item_memory and continuous_memory
+void HV_Memory::enable_retraining(HV_Memory* item_memory, HV_Memory* continuous_memory, int epochs, const std::string& cache_file) {
+    source_item_memory = item_memory;
+    source_continuous_memory = continuous_memory;
+    retrain_epochs = epochs;
+    retrain_cache_file = cache_file;
+    item_memory->retraining_source = true;
+    continuous_memory->retraining_source = true;
+}
+
+// The training set is encoded once (or loaded from the on-disk cache), then only the retraining epochs run
+void HV_Memory::train_with_retraining() {
+    HV_Memory& item_memory = *source_item_memory;
+    HV_Memory& continuous_memory = *source_continuous_memory;
+
+    if (!load_encoded_cache(retrain_cache_file, item_memory, continuous_memory, TRAINING_EMG_FILE, TRAINING_LABEL_FILE)) {
+        if (encode_training_set(item_memory, continuous_memory, TRAINING_EMG_FILE, TRAINING_LABEL_FILE) == 0) {
+            return;
+        }
+        save_encoded_cache(retrain_cache_file, item_memory, continuous_memory, TRAINING_EMG_FILE, TRAINING_LABEL_FILE);
+    }
+    retrain(retrain_epochs);
+}
+
+
 // SystemC main function with training and testing signal functionality
 int sc_main(int argc, char* argv[]) {
 
@@ -302,6 +761,10 @@ int sc_main(int argc, char* argv[]) {
     CiM.init_continuous_hv_memory();
     AM.init_hv_memory();
 
+
+    // the training pass of the AM runs the iterative retraining on the training set encoded with IM and CiM
+    AM.enable_retraining(&IM, &CiM, RETRAIN_EPOCHS, TRAINING_CACHE_FILE);
+
     // train and test signals are connected to the HV_Memory Module here
     IM.train(train);
     IM.test(test);
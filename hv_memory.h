@@ -3,6 +3,9 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <string>
+#include <vector>
+#include <stdint.h>
 
 #define DIMENSION 20//each hypervector(each row) has 20 components
 #define NUM_CLASS 5 // total number of class stored in the AM
@@ -10,6 +13,13 @@
 #define NUM_LEVELS 61
 #define MIN_LEVEL -2
 #define MAX_LEVEL 4
+#define NUM_CHANNELS 32 // number of EMG values (channels) in each training sample
+#define RETRAIN_EPOCHS 10 // default number of perceptron-style retraining epochs
+#define RETRAIN_SHARDS 8 // number of sample shards trained in parallel during each retraining epoch
+#define HV_WORDS ((DIMENSION + 31) / 32) // number of 32-bit words needed to store one packed bipolar hv
+#define TRAINING_EMG_FILE "C:/Users/arifb/Downloads/systemc-3.0.0/systemc-3.0.0/HDC_Exp3/training/training_emg.csv"
+#define TRAINING_LABEL_FILE "C:/Users/arifb/Downloads/systemc-3.0.0/systemc-3.0.0/HDC_Exp3/training/training_labels.csv"
+#define TRAINING_CACHE_FILE "C:/Users/arifb/Downloads/systemc-3.0.0/systemc-3.0.0/HDC_Exp3/training/training_encoded.bin" // "" keeps the encoded training set in memory only
 
 
 enum binary { ZERO = 0, ONE = 1 };
@@ -18,6 +28,7 @@ enum bipolar { MINUSONE = -1, ONE_BP = 1 };
 // Define two types: one for binary and one for bipolar
 typedef binary hv_bn[DIMENSION];
 typedef bipolar hv_bp[DIMENSION];
+typedef uint32_t hv_packed[HV_WORDS]; // bit-packed bipolar hv, a set bit means ONE_BP and a cleared bit means MINUSONE
 
 SC_MODULE(HV_Memory) {
 
@@ -30,11 +41,30 @@ SC_MODULE(HV_Memory) {
     hv_bn* memory_binary; // pointer to an array of binary hvs
     hv_bp* memory_bipolar; // pointer to an array of bipolar hvs
 
+    // Cache of the encoded training set, used by the retraining epochs
+    hv_packed* encoded_cache; // contiguous array of packed sample hvs
+    int* encoded_labels; // class id of each cached sample
+    int encoded_samples; // number of samples stored in the cache
+
+    // Retraining mode, set with enable_retraining()
+    HV_Memory* source_item_memory; // IM used to encode the training set, nullptr when retraining is disabled
+    HV_Memory* source_continuous_memory; // CiM used to encode the training set
+    int retrain_epochs;
+    std::string retrain_cache_file; // on-disk cache of the encoded training set, empty for in-memory only
+    bool retraining_source; // true for the IM and CiM of a retraining AM, their contents must not be changed by the training pass
+
     SC_CTOR(HV_Memory);
     HV_Memory(sc_module_name name, int entries) : sc_module(name), entries(entries)
     {
         memory_binary = nullptr;
         memory_bipolar = nullptr;
+        encoded_cache = nullptr;
+        encoded_labels = nullptr;
+        encoded_samples = 0;
+        source_item_memory = nullptr;
+        source_continuous_memory = nullptr;
+        retrain_epochs = 0;
+        retraining_source = false;
 
         if (is_binary) {
             memory_binary = (hv_bn*)malloc(entries * sizeof(hv_bn)); // Allocate memory for binary hvs
@@ -57,6 +87,7 @@ SC_MODULE(HV_Memory) {
             free(memory_bipolar);
             
         }
+        free_encoded_cache();
     }
 
 
@@ -97,16 +128,39 @@ SC_MODULE(HV_Memory) {
     void map_to_hv(float value, hv_bp& hypervector, bool is_feature);
     void map_emg_to_hv(const std::string& emg_file, const std::string& label_file);
 
+    // Iterative retraining: the training set is encoded once into encoded_cache, every epoch then only searches and updates the AM
+    void pack_hv(hv_bp& hv, hv_packed& packed); // Pack a bipolar hypervector into bits
+    int hamming_distance_packed(const hv_packed& hv1, const hv_packed& hv2); // Hamming distance between two packed hypervectors
+    int classify_packed(const hv_packed& query, hv_packed* am_packed); // Returns the class whose packed AM vector is closest to the query
+    void encode_sample(HV_Memory& item_memory, HV_Memory& continuous_memory, const std::vector<float>& emg_values, hv_packed& packed);
+    int encode_training_set(HV_Memory& item_memory, HV_Memory& continuous_memory, const std::string& emg_file, const std::string& label_file);
+    bool save_encoded_cache(const std::string& cache_file, HV_Memory& item_memory, HV_Memory& continuous_memory, const std::string& emg_file, const std::string& label_file);
+    bool load_encoded_cache(const std::string& cache_file, HV_Memory& item_memory, HV_Memory& continuous_memory, const std::string& emg_file, const std::string& label_file);
+    void free_encoded_cache();                // Free the encoded training set
+    uint32_t memory_checksum();               // Checksum of the stored hvs, used to detect stale on-disk caches
+    void retrain(int epochs);                 // Bundle the cached samples into the AM and run the retraining epochs
+    void enable_retraining(HV_Memory* item_memory, HV_Memory* continuous_memory, int epochs, const std::string& cache_file);
+    void train_with_retraining();             // Training pass of an AM in retraining mode
+
     
 
 
     // In current implementation, system assumes that it works with bipolar hvs only
     void process_signals() {
-        if (train.read()) {
+        if (train.read() && retraining_source) {
+            // the AM encodes the training set with this memory, so the legacy pass below must not overwrite it
+            std::cout << name() << " is used by retraining, skipping the training pass" << std::endl;
+        }
+        else if (train.read() && source_item_memory && source_continuous_memory) {
+            std::cout << "Training mode active (retraining)" << std::endl;
+            train_with_retraining();
+            print_hv_memory();
+        }
+        else if (train.read()) {
             std::cout << "Training mode active" << std::endl;
           
-            const std::string emg_file = "C:/Users/arifb/Downloads/systemc-3.0.0/systemc-3.0.0/HDC_Exp3/training/training_emg.csv";
-            const std::string label_file = "C:/Users/arifb/Downloads/systemc-3.0.0/systemc-3.0.0/HDC_Exp3/training/training_labels.csv";
+            const std::string emg_file = TRAINING_EMG_FILE;
+            const std::string label_file = TRAINING_LABEL_FILE;
             // Step 1: Map EMG and label data to hypervectors
             map_emg_to_hv(emg_file, label_file);
             // Step 2: Bind and Bundle each mapped EMG and label hypervector, and update AM